@@ -10,6 +10,7 @@
 #include <errno.h>
 // #define _GNU_SOURCE //strcasestr, dirent->d_type
 #include <string.h> //strcasestr strstr strdup
+#include <strings.h> // strcasecmp
 #include <sys/stat.h>
 #include <unistd.h> // readlink
 // #include <limits.h>
@@ -17,9 +18,15 @@
 #include <dlfcn.h> //dladdr
 #include <libgen.h> //dirname
 #include <ctype.h> // isspace
+#include <time.h> // clock_gettime
+#include <sys/syscall.h> // SYS_gettid
+#include <sys/socket.h>
+#include <sys/un.h>
 
 #include <mpv/client.h>
 
+#include "scan_service.h"
+
 // #define ARRAY_SIZE(arr) (sizeof(arr) / sizeof((arr)[0]))
 
 // #undef __USE_MISC // DEBUG
@@ -32,6 +39,21 @@
 fprintf(stderr, "%d:%s(): ", __LINE__, __func__); \
 fprintf(stderr, fmt,  ##__VA_ARGS__); } } while (0)
 
+// Record a resume checkpoint every this many directory entries.
+#define CHECKPOINT_INTERVAL 256
+
+// Number of past replace views that can be restored with "previous".
+#define VIEW_HISTORY_SIZE 16
+
+// Initial number of trace events the buffer can hold before it grows.
+#define TRACE_BUFFER_SIZE 4096
+
+// Default size of the blocks arenas get from malloc().
+#define ARENA_CHUNK_SIZE 4096
+
+// Subtitle and audio files read past the end of a batch to pair them with its files.
+#define SIDECAR_LOOKAHEAD 32
+
 // Values from Linux limits.h
 #ifndef PATH_MAX
 #define PATH_MAX 4096
@@ -55,28 +77,76 @@ char reset_memory = -1;
 
 static const char *g_loadCommand[] = {"loadfile", NULL, "append", NULL};
 
+typedef struct ArenaChunk arenaChunk;
+struct ArenaChunk {
+    arenaChunk *prev;
+    size_t size; // usable bytes in data
+    size_t used;
+    max_align_t data[];
+};
+
+/* Memory handed out by bumping a pointer and given back in bulk, either
+ * entirely or down to a previously taken mark.
+ */
+typedef struct Arena {
+    arenaChunk *head; // chunk allocations currently come from
+} arena;
+
+typedef struct ArenaMark {
+    arenaChunk *chunk;
+    size_t used;
+} arenaMark;
+
 typedef struct DirNode dirNode;
 struct DirNode {
-    char *name;  // name of the root directory
+    char *name;  // full path of a root directory, or name within the parent
     char isRootDir; // is part of initial playlist or not
     long offset; // value of dirent->d_off or telldir()
     time_t mtime;
+    uint64_t position; // number of entries read before offset
+    int64_t num_entries; // total number of entries, -1 if not known yet
+    long *checkpoints; // checkpoints[k - 1] is the offset of entry k * CHECKPOINT_INTERVAL
+    uint64_t num_checkpoints;
+    uint64_t *seen; // hashes of the entry names read so far
+    uint64_t num_seen;
+    uint64_t num_seen_sorted; // seen[0..num_seen_sorted) is sorted
+    uint64_t seen_capacity;
+    uint64_t seen_upto; // seen holds every entry before this one, see fingerprint_entry()
+    char rescan; // read again from the start, skipping the entries in seen
+    arena *arena; // holds the nodes below the root directory and their names
+    arenaMark mark; // state of arena before this node was allocated in it
     dirNode *next;
     dirNode *prev;
-    // int64_t num_entries; // number of files added last time
 };
 
-#define NODE_INITIALIZER(NAME, ISROOT, PREV) {\
+#define NODE_INITIALIZER(NAME, ISROOT, PREV, ARENA, MARK) {\
 .name = NAME, \
 .isRootDir = ISROOT,\
 .offset = 0,\
 .mtime = 0,\
+.position = 0,\
+.num_entries = -1,\
+.checkpoints = NULL,\
+.num_checkpoints = 0,\
+.seen = NULL,\
+.num_seen = 0,\
+.num_seen_sorted = 0,\
+.seen_capacity = 0,\
+.seen_upto = 0,\
+.rescan = 0,\
+.arena = ARENA,\
+.mark = MARK,\
 .next = NULL,\
 .prev = PREV\
 };
 
 unsigned char g_scriptActive = 0;
 unsigned char g_recurseDirs = 1;
+unsigned char g_lazyDirs = 0; // add sub-directories as placeholders
+
+// Placeholders are "limited_autoload://<path>#<offset>", where offset is a
+// telldir() value, or an entry number when prefixed with 'e' (scan service).
+static const char PLACEHOLDER_PREFIX[] = "limited_autoload://";
 
 typedef enum FileType {
     FT_DIR = 0,
@@ -102,8 +172,49 @@ struct PlaylistDescriptor g_InitialPL = {
     .entries = NULL
 };
 
+arena g_InitArena = { NULL }; // initial playlist entries and root nodes
+
 char *g_excludedExt[100] = { NULL }; // extensions we will ignore
 
+// External tracks paired with the files they are named after.
+static const char *SUB_EXTENSIONS[] = {"srt", "ass", "ssa", "vtt", "sub", "smi", NULL};
+static const char *AUDIO_EXTENSIONS[] = {"mka", "ac3", "eac3", "dts", NULL};
+unsigned char g_pairSidecars = 0;
+unsigned char g_mpvAutoScan = 1; // leave sub-auto and audio-file-auto alone
+
+unsigned char g_useScanService = 0;
+int g_scanService = -1; // socket connected to limited_autoloadd, or -1
+FILE *g_scanReplies = NULL; // reading end of g_scanService
+unsigned char g_scanServiceLost = 0; // cursors may still hold its entry numbers
+
+typedef struct ViewEntry {
+    char *path;
+    char *sub_files; // may be NULL
+    char *audio_files; // may be NULL
+} viewEntry;
+
+typedef struct View { // files loaded by one update in replace mode
+    arena strings; // holds the paths
+    viewEntry *entries;
+    uint64_t count;
+    uint64_t capacity;
+} view;
+
+struct ViewHistory { // ring buffer of the last replace views
+    view views[VIEW_HISTORY_SIZE];
+    int newest; // index in views of the most recently scanned view
+    int count; // number of views held
+    int back; // how many views behind the newest one is being displayed
+    char recording; // whether loaded files go into views[newest]
+};
+
+struct ViewHistory g_History = {
+    .newest = VIEW_HISTORY_SIZE - 1,
+    .count = 0,
+    .back = 0,
+    .recording = 0
+};
+
 int check_mpv_err(int status) {
     if ( status < MPV_ERROR_SUCCESS ) {
         printf("mpv API error %d: %s\n", status,
@@ -112,14 +223,176 @@ int check_mpv_err(int status) {
     return status; // == 0 for MPV_ERROR_SUCCESS
 }
 
-#if 0
-int on_before_start_file_handler(mpv_event *event) {
-    mpv_event_hook *hook = (mpv_event_hook *)event->data;
-    uint64_t id = hook->id;
-    mpv_hook_continue(g_Handle, id);
-    return 0;
+void *arena_alloc(arena *a, size_t size) {
+    size = (size + _Alignof(max_align_t) - 1) & ~(_Alignof(max_align_t) - 1);
+    arenaChunk *chunk = a->head;
+    if (chunk == NULL || chunk->size - chunk->used < size) {
+        size_t chunk_size = size > ARENA_CHUNK_SIZE ? size : ARENA_CHUNK_SIZE;
+        chunk = malloc(sizeof(arenaChunk) + chunk_size);
+        if (chunk == NULL) {
+            perror("arena_alloc()");
+            return NULL;
+        }
+        chunk->prev = a->head;
+        chunk->size = chunk_size;
+        chunk->used = 0;
+        a->head = chunk;
+    }
+    void *ptr = (char *)chunk->data + chunk->used;
+    chunk->used += size;
+    return ptr;
+}
+
+char *arena_strdup(arena *a, const char *str) {
+    size_t len = strlen(str) + 1;
+    char *copy = arena_alloc(a, len);
+    if (copy != NULL)
+        memcpy(copy, str, len);
+    return copy;
+}
+
+arenaMark arena_mark(arena *a) {
+    arenaMark mark = { a->head, a->head ? a->head->used : 0 };
+    return mark;
+}
+
+/* Give back everything allocated since mark was taken.
+ */
+void arena_release(arena *a, arenaMark mark) {
+    while (a->head != mark.chunk) {
+        arenaChunk *prev = a->head->prev;
+        free(a->head);
+        a->head = prev;
+    }
+    if (a->head != NULL)
+        a->head->used = mark.used;
+}
+
+void arena_reset(arena *a) {
+    arenaMark empty = { NULL, 0 };
+    arena_release(a, empty);
+}
+
+typedef struct TraceEvent { // a Chrome trace "complete" event
+    const char *name; // string literal
+    uint64_t ts; // start, in microseconds
+    uint64_t dur; // duration, in microseconds
+    char *path; // directory the event relates to, may be NULL
+} traceEvent;
+
+/* All the work happens on the thread mpv runs this plugin on, so a single
+ * buffer is effectively the per-thread buffer of that thread. It grows as
+ * needed so that nothing is written out while an update is being measured.
+ */
+struct TraceBuffer {
+    FILE *fp; // NULL when tracing is disabled
+    long tid;
+    size_t count;
+    size_t capacity;
+    traceEvent *events;
+};
+
+struct TraceBuffer g_Trace = {
+    .fp = NULL,
+    .count = 0,
+    .capacity = 0,
+    .events = NULL
+};
+
+/* @return the current time in microseconds, or 0 if tracing is disabled.
+ */
+uint64_t trace_now(void) {
+    if (g_Trace.fp == NULL)
+        return 0;
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+void fputs_json_escaped(const char *str, FILE *fp) {
+    for (; *str != '\0'; ++str) {
+        unsigned char c = (unsigned char)*str;
+        if (c == '"' || c == '\\') {
+            fputc('\\', fp);
+            fputc(c, fp);
+        } else if (c < 0x20) {
+            fprintf(fp, "\\u%04x", c);
+        } else {
+            fputc(c, fp);
+        }
+    }
+}
+
+void trace_flush(void) {
+    if (g_Trace.fp == NULL)
+        return;
+    for (size_t i = 0; i < g_Trace.count; ++i) {
+        traceEvent *ev = &g_Trace.events[i];
+        fprintf(g_Trace.fp, "{\"name\":\"%s\",\"cat\":\"limited_autoload\","
+                "\"ph\":\"X\",\"ts\":%lu,\"dur\":%lu,\"pid\":%d,\"tid\":%ld",
+                ev->name, ev->ts, ev->dur, (int)getpid(), g_Trace.tid);
+        if (ev->path != NULL) {
+            fputs(",\"args\":{\"path\":\"", g_Trace.fp);
+            fputs_json_escaped(ev->path, g_Trace.fp);
+            fputs("\"}", g_Trace.fp);
+            free(ev->path);
+        }
+        fputs("},\n", g_Trace.fp);
+    }
+    g_Trace.count = 0;
+    fflush(g_Trace.fp);
+}
+
+/* Record an event which started at start, as returned by trace_now(), and
+ * ends now. Events are only written out by trace_flush().
+ */
+void trace_event(const char *name, uint64_t start, const char *path) {
+    if (g_Trace.fp == NULL)
+        return;
+    if (g_Trace.count == g_Trace.capacity) {
+        size_t capacity = g_Trace.capacity ? g_Trace.capacity * 2 : TRACE_BUFFER_SIZE;
+        traceEvent *events = realloc(g_Trace.events, capacity * sizeof(traceEvent));
+        if (events == NULL)
+            return;
+        g_Trace.events = events;
+        g_Trace.capacity = capacity;
+    }
+    traceEvent *ev = &g_Trace.events[g_Trace.count++];
+    ev->name = name;
+    ev->ts = start;
+    ev->dur = trace_now() - start;
+    ev->path = path ? strdup(path) : NULL;
+}
+
+void trace_close(void) {
+    if (g_Trace.fp == NULL)
+        return;
+    trace_flush();
+    // The last event closes the JSON array, hence no trailing comma.
+    fprintf(g_Trace.fp, "{\"name\":\"process_name\",\"ph\":\"M\",\"pid\":%d,"
+            "\"args\":{\"name\":\"mpv\"}}\n]\n", (int)getpid());
+    fclose(g_Trace.fp);
+    g_Trace.fp = NULL;
+    free(g_Trace.events);
+    g_Trace.events = NULL;
+    g_Trace.capacity = 0;
+}
+
+/* Start writing Chrome trace events (chrome://tracing, ui.perfetto.dev)
+ * to the file at path.
+ */
+void trace_open(const char *path) {
+    trace_close();
+    g_Trace.fp = fopen(path, "w");
+    if (g_Trace.fp == NULL) {
+        perror(path);
+        return;
+    }
+    g_Trace.tid = syscall(SYS_gettid);
+    g_Trace.count = 0;
+    fputs("[\n", g_Trace.fp);
+    debug_print("Tracing to %s.\n", path);
 }
-#endif
 
 /* @param count number of item returned by property "playlist-count".
  */
@@ -200,21 +473,587 @@ char has_excluded_extension(const char *filename) {
     return 0;
 }
 
-void append_to_playlist(const char * path) {
-    const char *cmd[] = {"loadfile", path, "append", NULL};
-    int err = mpv_command(g_Handle, cmd);
+void record_in_view(const char *path, const char *sub_files,
+                    const char *audio_files) {
+    view *v = &g_History.views[g_History.newest];
+    if (v->count == v->capacity) {
+        uint64_t capacity = v->capacity ? v->capacity * 2 : 64;
+        viewEntry *entries = realloc(v->entries, capacity * sizeof(viewEntry));
+        if (entries == NULL) {
+            perror("record_in_view()");
+            return;
+        }
+        v->entries = entries;
+        v->capacity = capacity;
+    }
+    viewEntry *entry = &v->entries[v->count++];
+    entry->path = arena_strdup(&v->strings, path);
+    entry->sub_files = sub_files ? arena_strdup(&v->strings, sub_files) : NULL;
+    entry->audio_files = audio_files ? arena_strdup(&v->strings, audio_files) : NULL;
+}
+
+/* @param sub_files, audio_files external tracks to load along with path, as
+ * a ':' separated list of paths, or NULL.
+ */
+void append_to_playlist(const char * path, const char *sub_files,
+                        const char *audio_files) {
+    uint64_t t0 = trace_now();
+    int err;
+    if (sub_files == NULL && audio_files == NULL) {
+        g_loadCommand[1] = path;
+        err = mpv_command(g_Handle, g_loadCommand);
+    } else {
+        // Per-file options can only be passed as named arguments reliably
+        // across mpv versions.
+        mpv_node opt_values[2];
+        char *opt_keys[2];
+        mpv_node_list opt_list = { 0, opt_values, opt_keys };
+        if (sub_files != NULL) {
+            opt_keys[opt_list.num] = "sub-files";
+            opt_values[opt_list.num].format = MPV_FORMAT_STRING;
+            opt_values[opt_list.num++].u.string = (char *)sub_files;
+        }
+        if (audio_files != NULL) {
+            opt_keys[opt_list.num] = "audio-files";
+            opt_values[opt_list.num].format = MPV_FORMAT_STRING;
+            opt_values[opt_list.num++].u.string = (char *)audio_files;
+        }
+        mpv_node values[4] = {
+            { .format = MPV_FORMAT_STRING, .u.string = "loadfile" },
+            { .format = MPV_FORMAT_STRING, .u.string = (char *)path },
+            { .format = MPV_FORMAT_STRING, .u.string = "append" },
+            { .format = MPV_FORMAT_NODE_MAP, .u.list = &opt_list }
+        };
+        char *keys[4] = {"name", "url", "flags", "options"};
+        mpv_node_list list = { 4, values, keys };
+        mpv_node cmd = { .format = MPV_FORMAT_NODE_MAP, .u.list = &list };
+        err = mpv_command_node(g_Handle, &cmd, NULL);
+    }
+    trace_event("mpv_command", t0, NULL);
     check_mpv_err(err);
+    if (g_History.recording) {
+        record_in_view(path, sub_files, audio_files);
+    }
+}
+
+/* @return 's' for a subtitle file, 'a' for an audio track file, 0 otherwise.
+ */
+char sidecar_type(const char *filename) {
+    const char *dot = strrchr(filename, '.');
+    if (!dot || dot == filename) return 0;
+
+    for (int i = 0; SUB_EXTENSIONS[i] != NULL; ++i) {
+        if (strcasecmp(dot + 1, SUB_EXTENSIONS[i]) == 0)
+            return 's';
+    }
+    for (int i = 0; AUDIO_EXTENSIONS[i] != NULL; ++i) {
+        if (strcasecmp(dot + 1, AUDIO_EXTENSIONS[i]) == 0)
+            return 'a';
+    }
+    return 0;
+}
+
+void drop_checkpoints(dirNode *node) {
+    free(node->checkpoints);
+    node->checkpoints = NULL;
+    node->num_checkpoints = 0;
+    node->num_entries = -1;
 }
 
+/* Release every node below node at once. As nodes are only ever added to or
+ * removed from the end of the list, they are the last ones in the arena.
+ */
 void free_nodes(dirNode* node){
-    while(node->next != NULL) {
-        node = node->next;
+    if (node->next == NULL)
+        return;
+    arenaMark mark = node->next->mark;
+    for (dirNode *n = node->next; n != NULL; n = n->next) {
+        free(n->checkpoints);
+        free(n->seen);
+    }
+    arena_release(node->arena, mark);
+    node->next = NULL;
+}
+
+/* Write the full path of node into buf, from the names of its parents.
+ */
+void node_path(const dirNode *node, char *buf, size_t size) {
+    if (node->prev == NULL) {
+        snprintf(buf, size, "%s", node->name);
+        return;
+    }
+    node_path(node->prev, buf, size);
+    size_t len = strlen(buf);
+    snprintf(buf + len, size - len, "/%s", node->name);
+}
+
+void forget_seen(dirNode *node) {
+    free(node->seen);
+    node->seen = NULL;
+    node->num_seen = 0;
+    node->num_seen_sorted = 0;
+    node->seen_capacity = 0;
+    node->seen_upto = 0;
+}
+
+// 64-bit FNV-1a
+uint64_t hash_name(const char *name) {
+    uint64_t hash = 0xcbf29ce484222325ULL;
+    for (; *name != '\0'; ++name) {
+        hash ^= (unsigned char)*name;
+        hash *= 0x100000001b3ULL;
+    }
+    return hash;
+}
+
+int compare_hashes(const void *a, const void *b) {
+    uint64_t x = *(const uint64_t *)a;
+    uint64_t y = *(const uint64_t *)b;
+    return (x > y) - (x < y);
+}
+
+void remember_seen(dirNode *node, uint64_t hash) {
+    if (node->num_seen == node->seen_capacity) {
+        uint64_t capacity = node->seen_capacity ? node->seen_capacity * 2 : 64;
+        uint64_t *seen = realloc(node->seen, capacity * sizeof(uint64_t));
+        if (seen == NULL) {
+            perror("remember_seen()");
+            return;
+        }
+        node->seen = seen;
+        node->seen_capacity = capacity;
+    }
+    node->seen[node->num_seen++] = hash;
+}
+
+/* Only looks into the sorted part of the fingerprint, ie. the entries that
+ * were read before the last call to sort_seen().
+ */
+char is_seen(dirNode *node, uint64_t hash) {
+    return node->num_seen_sorted > 0
+        && bsearch(&hash, node->seen, node->num_seen_sorted,
+                   sizeof(uint64_t), compare_hashes) != NULL;
+}
+
+void sort_seen(dirNode *node) {
+    if (node->num_seen_sorted == node->num_seen)
+        return;
+    qsort(node->seen, node->num_seen, sizeof(uint64_t), compare_hashes);
+    node->num_seen_sorted = node->num_seen;
+}
+
+/* Add the entry just read, at node->position, to the fingerprint. The
+ * entries page/jump go past without reading them leave a gap in it, which is
+ * why seen_upto tracks how far it covers the directory without one.
+ * @return 1 if the entry was already part of the fingerprint.
+ */
+char fingerprint_entry(dirNode *node, uint64_t hash) {
+    char known = is_seen(node, hash);
+    if (!known)
+        remember_seen(node, hash);
+    if (node->seen_upto + 1 == node->position)
+        node->seen_upto = node->position;
+    return known;
+}
+
+/* Called each time node->position is incremented. Every CHECKPOINT_INTERVAL
+ * entries, remember the offset right after the current entry, so that this
+ * part of the directory can later be reached with a single seekdir().
+ * checkpoints[k - 1] holds the offset of entry k * CHECKPOINT_INTERVAL.
+ */
+void record_checkpoint(dirNode *node, long offset) {
+    if (node->position % CHECKPOINT_INTERVAL != 0)
+        return;
+    uint64_t k = node->position / CHECKPOINT_INTERVAL;
+    if (k != node->num_checkpoints + 1) // already known
+        return;
+    long *checkpoints = realloc(node->checkpoints, k * sizeof(long));
+    if (checkpoints == NULL) {
+        perror("record_checkpoint()");
+        return;
+    }
+    checkpoints[k - 1] = offset;
+    node->checkpoints = checkpoints;
+    node->num_checkpoints = k;
+}
+
+void scan_service_connect(void) {
+    struct sockaddr_un addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    scan_service_socket_path(addr.sun_path, sizeof(addr.sun_path));
+
+    int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (fd < 0) {
+        perror("socket");
+        return;
+    }
+    if (connect(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+        debug_print("No scan service at %s, scanning in-process.\n", addr.sun_path);
+        close(fd);
+        return;
+    }
+    // Without XDG_RUNTIME_DIR, anyone could have bound the socket first.
+    struct ucred cred;
+    socklen_t cred_len = sizeof(cred);
+    if (getsockopt(fd, SOL_SOCKET, SO_PEERCRED, &cred, &cred_len) < 0
+        || cred.uid != getuid()) {
+        fprintf(stderr, "[%s] %s does not belong to us, scanning in-process.\n",
+                mpv_client_name(g_Handle), addr.sun_path);
+        close(fd);
+        return;
+    }
+    g_scanReplies = fdopen(fd, "r");
+    if (g_scanReplies == NULL) {
+        perror("fdopen");
+        close(fd);
+        return;
+    }
+    g_scanService = fd;
+    debug_print("Connected to scan service at %s.\n", addr.sun_path);
+}
+
+void scan_service_disconnect(void) {
+    if (g_scanService < 0)
+        return;
+    fclose(g_scanReplies); // closes g_scanService too
+    g_scanReplies = NULL;
+    g_scanService = -1;
+}
+
+/* Entries of a directory, read either from storage or from the scan
+ * service. With the scan service, offsets are entry numbers.
+ */
+typedef struct DirStream {
+    DIR *dir; // NULL when the entries come from the scan service
+    const char *path;
+    long index; // number of the next entry from the scan service
+    struct dirent *batch; // entries received from the scan service
+    int batch_count;
+    int batch_pos;
+    char eof; // the scan service has no more entries after this batch
+} dirStream;
+
+/* @return 0 on success, -1 with errno set otherwise.
+ */
+int dir_open_local(dirStream *ds, const char *path) {
+    memset(ds, 0, sizeof(dirStream));
+    ds->path = path;
+    ds->dir = opendir(path);
+    return ds->dir == NULL ? -1 : 0;
+}
+
+/* Read from the scan service if possible, from storage otherwise.
+ * @return 0 on success, -1 with errno set otherwise.
+ */
+int dir_open(dirStream *ds, const char *path) {
+    // The service has no idea of our working directory, and we cannot
+    // send new lines in requests.
+    if (g_scanService >= 0 && path[0] == '/' && strchr(path, '\n') == NULL) {
+        memset(ds, 0, sizeof(dirStream));
+        ds->path = path;
+        return 0;
+    }
+    return dir_open_local(ds, path);
+}
+
+/* Request the next batch of entries from the scan service.
+ * @return 0 on success, -1 with errno set otherwise.
+ */
+int fetch_batch(dirStream *ds) {
+    if (g_scanService < 0) { // lost it while reading another directory
+        errno = EIO;
+        return -1;
+    }
+    if (ds->batch == NULL) {
+        ds->batch = malloc(SCAN_BATCH * sizeof(struct dirent));
+        if (ds->batch == NULL)
+            return -1;
+    }
+    ds->batch_count = 0;
+    ds->batch_pos = 0;
+
+    char request[PATH_MAX + 64];
+    int len = snprintf(request, sizeof(request), "READ %ld %d %s\n",
+                       ds->index, SCAN_BATCH, ds->path);
+    if (len >= sizeof(request)) {
+        errno = ENAMETOOLONG;
+        return -1;
+    }
+    if (send(g_scanService, request, len, MSG_NOSIGNAL) != len)
+        goto lost;
+
+    char header[64];
+    if (fgets(header, sizeof(header), g_scanReplies) == NULL)
+        goto lost;
+    int count, eof, err;
+    if (sscanf(header, "ERR %d", &err) == 1) {
+        errno = err;
+        return -1;
+    }
+    if (sscanf(header, "OK %d %d", &count, &eof) != 2 || count > SCAN_BATCH)
+        goto lost;
+
+    for (int i = 0; i < count; ++i) {
+        struct dirent *entry = &ds->batch[i];
+        char type;
+        unsigned int name_len;
+        if (fscanf(g_scanReplies, "%c %u", &type, &name_len) != 2
+            || name_len >= sizeof(entry->d_name)
+            || fgetc(g_scanReplies) != ' '
+            || fread(entry->d_name, 1, name_len, g_scanReplies) != name_len
+            || fgetc(g_scanReplies) != '\n')
+            goto lost;
+        entry->d_name[name_len] = '\0';
+        // Names are joined to paths we load and recurse into.
+        if (name_len == 0 || memchr(entry->d_name, '/', name_len) != NULL
+            || memchr(entry->d_name, '\0', name_len) != NULL
+            || strcmp(entry->d_name, ".") == 0 || strcmp(entry->d_name, "..") == 0)
+            goto lost;
+#if defined __USE_MISC && defined _DIRENT_HAVE_D_TYPE
+        entry->d_type = type == 'd' ? DT_DIR : DT_REG;
+#endif
+#if defined __USE_MISC && defined _DIRENT_HAVE_D_OFF
+        entry->d_off = ds->index + i + 1;
+#endif
+    }
+    ds->batch_count = count;
+    ds->eof = eof;
+    return 0;
+
+lost:
+    fprintf(stderr, "[%s] Lost the scan service, scanning in-process.\n",
+            mpv_client_name(g_Handle));
+    scan_service_disconnect();
+    g_scanServiceLost = 1;
+    errno = EIO;
+    return -1;
+}
+
+/* @return NULL at the end of the directory, or with errno set on error.
+ */
+struct dirent *dir_read(dirStream *ds) {
+    if (ds->dir != NULL)
+        return readdir(ds->dir);
+
+    if (ds->batch_pos == ds->batch_count) {
+        if (ds->eof)
+            return NULL;
+        if (fetch_batch(ds) < 0)
+            return NULL;
+        if (ds->batch_count == 0)
+            return NULL;
+    }
+    ds->index++;
+    return &ds->batch[ds->batch_pos++];
+}
+
+void dir_seek(dirStream *ds, long offset) {
+    if (ds->dir != NULL) {
+        seekdir(ds->dir, offset);
+        return;
+    }
+    ds->index = offset;
+    ds->batch_count = 0;
+    ds->batch_pos = 0;
+    ds->eof = 0;
+}
+
+void dir_rewind(dirStream *ds) {
+    if (ds->dir != NULL) {
+        rewinddir(ds->dir);
+        return;
+    }
+    dir_seek(ds, 0);
+}
+
+long dir_tell(dirStream *ds) {
+    if (ds->dir != NULL)
+        return telldir(ds->dir);
+    return ds->index;
+}
+
+void dir_close(dirStream *ds) {
+    if (ds->dir != NULL)
+        closedir(ds->dir);
+    free(ds->batch);
+}
+
+/* Regular files of a directory read by one call to enumerate_dir(), held
+ * back until the end of it so that subtitle and audio files can be paired
+ * with the files they belong to. Only names, the directory is known.
+ */
+typedef struct PendingFiles {
+    char **names;
+    uint64_t count;
+    uint64_t capacity;
+} pendingFiles;
+
+void pending_add(pendingFiles *p, const char *name) {
+    if (p->count == p->capacity) {
+        uint64_t capacity = p->capacity ? p->capacity * 2 : 16;
+        char **names = realloc(p->names, capacity * sizeof(char *));
+        if (names == NULL) {
+            perror("pending_add()");
+            return;
+        }
+        p->names = names;
+        p->capacity = capacity;
+    }
+    if ((p->names[p->count] = strdup(name)) != NULL)
+        p->count++;
+}
+
+/* movie.mkv gets movie.srt, movie.en.srt, but not movie2.srt.
+ */
+char is_sidecar_of(const char *sidecar, const char *name) {
+    if (sidecar_type(name) != 0 || sidecar_type(sidecar) == 0)
+        return 0;
+    if (strchr(sidecar, ':') != NULL) // list separator
+        return 0;
+    const char *dot = strrchr(name, '.');
+    size_t stem_len = (dot && dot != name) ? dot - name : strlen(name);
+    return strncmp(sidecar, name, stem_len) == 0 && sidecar[stem_len] == '.';
+}
+
+/* sub-files and audio-files are ':' separated lists, with no way to escape
+ * it. In a directory whose path has one, files are left unpaired.
+ */
+char can_pair_in(const char *szDirPath) {
+    return strchr(szDirPath, ':') == NULL;
+}
+
+/* @return 1 if sidecar belongs to one of the other files of p.
+ */
+char has_owner(const pendingFiles *p, const char *sidecar) {
+    for (uint64_t i = 0; i < p->count; ++i) {
+        if (is_sidecar_of(sidecar, p->names[i]))
+            return 1;
+    }
+    return 0;
+}
+
+/* After the last entry of a batch, take along the subtitle and audio files
+ * which directly follow it and belong to one of its files, up to
+ * SIDECAR_LOOKAHEAD of them. The stream is left right before the first entry
+ * not taken. Entries taken are accounted for in node, if not NULL.
+ */
+void take_trailing_sidecars(dirStream *ds, pendingFiles *p, dirNode *node) {
+    for (int taken = 0; taken < SIDECAR_LOOKAHEAD; ) {
+        long offset = dir_tell(ds);
+        struct dirent *entry = dir_read(ds);
+        if (entry == NULL)
+            return;
+        if (strcmp(entry->d_name, ".") == 0 || strcmp(entry->d_name, "..") == 0)
+            continue;
+        if (
+#if defined __USE_MISC && defined _DIRENT_HAVE_D_TYPE
+            entry->d_type == DT_DIR ||
+#endif
+            has_excluded_extension(entry->d_name)
+            || !has_owner(p, entry->d_name)) {
+            dir_seek(ds, offset);
+            return;
+        }
+        if (node != NULL) {
+            node->position++;
+#if defined __USE_MISC && defined _DIRENT_HAVE_D_OFF
+            record_checkpoint(node, entry->d_off);
+#else
+            record_checkpoint(node, dir_tell(ds));
+#endif
+            fingerprint_entry(node, hash_name(entry->d_name));
+        }
+        pending_add(p, entry->d_name);
+        taken++;
+    }
+}
+
+void pending_clear(pendingFiles *p) {
+    for (uint64_t i = 0; i < p->count; ++i)
+        free(p->names[i]);
+    free(p->names);
+    p->names = NULL;
+    p->count = 0;
+    p->capacity = 0;
+}
+
+/* Add the files of p in directory szDirPath to the playlist, each along with
+ * the subtitle and audio files of p named after it. These are not added on
+ * their own, unlike the ones no file of p claims.
+ */
+void flush_pending(pendingFiles *p, const char *szDirPath) {
+    uint64_t t0 = trace_now();
+    char pair = can_pair_in(szDirPath);
+    for (uint64_t i = 0; i < p->count; ++i) {
+        const char *name = p->names[i];
+        if (pair && sidecar_type(name) != 0 && has_owner(p, name))
+            continue;
+
+        char *lists[2] = { NULL, NULL }; // subtitles, audio
+        size_t lens[2] = { 0, 0 };
+        FILE *outs[2] = { NULL, NULL };
+        for (uint64_t j = 0; pair && j < p->count; ++j) {
+            const char *sidecar = p->names[j];
+            if (!is_sidecar_of(sidecar, name))
+                continue;
+            int k = sidecar_type(sidecar) == 's' ? 0 : 1;
+            if (outs[k] == NULL) {
+                outs[k] = open_memstream(&lists[k], &lens[k]);
+                if (outs[k] == NULL)
+                    continue;
+            } else {
+                fputc(':', outs[k]);
+            }
+            fprintf(outs[k], "%s/%s", szDirPath, sidecar);
+            debug_print("Paired %s with %s.\n", sidecar, name);
+        }
+        for (int k = 0; k < 2; ++k) {
+            if (outs[k] != NULL)
+                fclose(outs[k]);
+        }
+
+        char szFullPath[PATH_MAX];
+        snprintf(szFullPath, sizeof(szFullPath), "%s/%s", szDirPath, name);
+        append_to_playlist(szFullPath, lists[0], lists[1]);
+        free(lists[0]);
+        free(lists[1]);
     }
-    while (node->prev != NULL) {
-        node = node->prev;
-        free(node->next);
-        node->next = NULL;
+    pending_clear(p);
+    if (g_pairSidecars)
+        trace_event("pair_sidecars", t0, szDirPath);
+}
+
+/* Same as flush_pending(), for a playlist written to out. Such entries cannot
+ * carry options, so the subtitle and audio files claimed by a file of p are
+ * only left out when mpv is to find them again on its own. Otherwise they
+ * are written as regular entries.
+ */
+void write_pending(pendingFiles *p, const char *path, FILE *out) {
+    char pair = g_mpvAutoScan && can_pair_in(path);
+    for (uint64_t i = 0; i < p->count; ++i) {
+        const char *name = p->names[i];
+        if (pair && sidecar_type(name) != 0 && has_owner(p, name))
+            continue;
+        if (strchr(name, '\n') != NULL) // cannot be written in a playlist
+            continue;
+        fprintf(out, "%s/%s\n", path, name);
     }
+    pending_clear(p);
+}
+
+/* Add a placeholder for the entries of the directory at path, starting at
+ * offset. It is only read when playback reaches it, see on_load_handler().
+ */
+void append_placeholder(const char *path, long offset) {
+    char url[PATH_MAX + 64];
+    if (snprintf(url, sizeof(url), "%s%s#%ld", PLACEHOLDER_PREFIX, path, offset)
+        >= sizeof(url)) {
+        fprintf(stderr, "Path too long: %s.\n", path);
+        return;
+    }
+    append_to_playlist(url, NULL, NULL);
+    debug_print("added placeholder to playlist: %s.\n", url);
 }
 
 /* In this implementation, we don't really care about the order of
@@ -231,28 +1070,67 @@ int enumerate_dir( dirNode *node,
                     uint64_t iAmount,
                     uint64_t *iAddedFiles )
 {
-    DIR *_dir = NULL;
-    const char *szDirPath = node->name;
-    _dir = opendir(szDirPath);
-    if (_dir == NULL) return 1;
+    if (g_scanServiceLost) // node->offset may be one of its entry numbers
+        return 0;
+    dirStream _dir;
+    char szDirPath[PATH_MAX];
+    node_path(node, szDirPath, sizeof(szDirPath));
+    uint64_t t_dir = trace_now();
+    uint64_t t0 = t_dir;
+    int opened = dir_open(&_dir, szDirPath);
+    trace_event("opendir", t0, NULL);
+    if (opened < 0) {
+        trace_event("enumerate_dir", t_dir, szDirPath);
+        return 1;
+    }
 
     errno = 0;
     struct stat st;
 
+    t0 = trace_now();
     if (stat(szDirPath, &st) < 0) {
         perror(szDirPath);
     }
+    trace_event("stat", t0, NULL);
     if (node->mtime == 0) { // Initialize mtime for this directory
         node->mtime = st.st_mtime;
     }
-    if (node->offset > 0) {
+    // Set when the directory changed: entries we already read are skipped
+    // without being stat()ed or added again, the first new one gets us back
+    // to where we were.
+    char skip_seen = 0;
+    // Whether position counts every entry since the start of the directory,
+    // ie. whether it is the number of entries once the end is reached.
+    char counted = 1;
+    pendingFiles pending = { NULL, 0, 0 };
+    if (node->rescan) {
+        debug_print("Reading %s again, skipping %lu known entries.\n",
+                    szDirPath, node->num_seen);
+        node->rescan = 0;
+        sort_seen(node);
+        skip_seen = 1;
+    } else if (node->offset > 0) {
         // debug_print("MTIME for %s: %lu\n", node->name, node->mtime);
-        if (node->mtime != st.st_mtime) {
-            debug_print("%s mtime changed! Starting over.\n", szDirPath);
+        if (node->mtime != st.st_mtime && node->seen_upto < node->position) {
+            // Entries before the cursor are missing from the fingerprint, they
+            // would all look new: carry on from where we were instead.
+            debug_print("%s mtime changed! Fingerprint incomplete, resuming at offset %ld.\n",
+                        szDirPath, node->offset);
+            drop_checkpoints(node);
+            counted = 0;
+            dir_seek(&_dir, node->offset);
+        } else if (node->mtime != st.st_mtime) {
+            debug_print("%s mtime changed! Skipping %lu known entries.\n",
+                        szDirPath, node->num_seen);
             node->offset = 0;
+            node->position = 0;
+            node->seen_upto = 0;
+            drop_checkpoints(node);
+            sort_seen(node);
+            skip_seen = 1;
         } else {
             debug_print("Opening %s at offset %ld.\n", szDirPath, node->offset);
-            seekdir(_dir, node->offset);
+            dir_seek(&_dir, node->offset);
         }
     }
     long prev_offset = node->offset;
@@ -263,16 +1141,25 @@ int enumerate_dir( dirNode *node,
     while (*iAddedFiles < iAmount) {
         errno = 0;
         entry = NULL;
-        entry = readdir(_dir);
+        t0 = trace_now();
+        entry = dir_read(&_dir);
+        trace_event("readdir", t0, NULL);
 
         if (entry == NULL) { // end of stream
             if (errno != 0) {
                 // TODO handle errors properly
-                perror(szDirPath);
+                if (!g_scanServiceLost) // already reported
+                    perror(szDirPath);
+                flush_pending(&pending, szDirPath);
+                dir_close(&_dir);
+                trace_event("enumerate_dir", t_dir, szDirPath);
                 return 1;
             }
             debug_print("No more entry found in %s.\n", szDirPath);
 
+            // After a rewind, the stream may well end right away again.
+            if (counted && !rewound)
+                node->num_entries = node->position;
             node->offset = 0;
             if (node->isRootDir) {
                 if (g_lastMethod == M_REPLACE) {
@@ -281,7 +1168,10 @@ int enumerate_dir( dirNode *node,
                     if (rewound) {
                         break;
                     }
-                    rewinddir(_dir);
+                    dir_rewind(&_dir);
+                    node->position = 0;
+                    forget_seen(node);
+                    skip_seen = 0;
                     rewound = 1;
                     continue;
                 }
@@ -289,7 +1179,9 @@ int enumerate_dir( dirNode *node,
                 break;
             }
             // NOT a root dir, we don't care about it anymore
-            closedir(_dir);
+            flush_pending(&pending, szDirPath);
+            dir_close(&_dir);
+            trace_event("enumerate_dir", t_dir, szDirPath);
             return 1;
         }
 
@@ -298,14 +1190,32 @@ int enumerate_dir( dirNode *node,
         if (strcmp(name, ".") == 0 || strcmp(name, "..") == 0)
             continue;
 
+#if defined __USE_MISC && defined _DIRENT_HAVE_D_OFF
+        long entry_offset = entry->d_off;
+#else
+        long entry_offset = dir_tell(&_dir);
+#endif
+        node->position++;
+        record_checkpoint(node, entry_offset);
+
+        if (fingerprint_entry(node, hash_name(name)) && skip_seen)
+            continue;
+
         // Build absolute path from szDirPath
         char szFullPath[PATH_MAX];
-        snprintf(szFullPath, sizeof(szFullPath), "%s/%s", szDirPath, name);
+        if (snprintf(szFullPath, sizeof(szFullPath), "%s/%s", szDirPath, name)
+            >= sizeof(szFullPath)) {
+            fprintf(stderr, "Path too long in %s.\n", szDirPath);
+            continue;
+        }
         // debug_print("Found entry: %s.\n", szFullPath);
 
 #if defined __USE_MISC && defined _DIRENT_HAVE_D_TYPE // might not be the right macros to test for
         if (entry->d_type == DT_UNKNOWN || entry->d_type == DT_LNK) {
-            if (stat(szFullPath, &st) < 0) {
+            t0 = trace_now();
+            int err = stat(szFullPath, &st);
+            trace_event("stat", t0, NULL);
+            if (err < 0) {
                 perror(szFullPath);
                 continue;
             }
@@ -317,7 +1227,10 @@ int enumerate_dir( dirNode *node,
         else if (entry->d_type == DT_DIR) {
             isdir:
 #else
-        if (stat(szFullPath, &st) < 0) {
+        t0 = trace_now();
+        int err = stat(szFullPath, &st);
+        trace_event("stat", t0, NULL);
+        if (err < 0) {
             perror(szFullPath);
             continue;
         }
@@ -326,26 +1239,32 @@ int enumerate_dir( dirNode *node,
             debug_print("DIRECTORY detected: %s.\n", entry->d_name);
             if (g_recurseDirs != 1)
                 continue;
-            dirNode *_dt = (dirNode *)calloc(1, sizeof(dirNode));
-            if (_dt == NULL) {
-                perror(szFullPath);
+            if (g_lazyDirs) {
+                append_placeholder(szFullPath, 0);
+                (*iAddedFiles)++;
+                continue;
+            }
+            arenaMark mark = arena_mark(node->arena);
+            dirNode *_dt = arena_alloc(node->arena, sizeof(dirNode));
+            char *_name = arena_strdup(node->arena, name);
+            if (_dt == NULL || _name == NULL) {
+                arena_release(node->arena, mark);
+                flush_pending(&pending, szDirPath);
+                dir_close(&_dir);
                 return 1;
             }
             node->next = _dt;
-            *(_dt) = (dirNode)NODE_INITIALIZER(strdup(szFullPath), 0, node);
+            *(_dt) = (dirNode)NODE_INITIALIZER(_name, 0, node, node->arena, mark);
 
-#if defined __USE_MISC && defined _DIRENT_HAVE_D_OFF
-            node->offset = entry->d_off;
-#else
-            node->offset = telldir(_dir);
-#endif
+            node->offset = entry_offset;
             debug_print("saved current offset for %s: %lu.\n", node->name, node->offset);
 
-            if(enumerate_dir(node->next, iAmount, iAddedFiles) == 1){
+            int done = enumerate_dir(node->next, iAmount, iAddedFiles);
+            if (g_scanServiceLost) // the entries we hold are its own
+                break;
+            if (done == 1) {
                 debug_print("enumerate()->free() %s\n", node->next->name);
-                free(node->next->name);
-                free(node->next);
-                node->next = NULL;
+                free_nodes(node);
             }
             continue; // go get the left over files in the current directory
         }
@@ -359,38 +1278,186 @@ int enumerate_dir( dirNode *node,
             continue;
         }
 
-#if defined __USE_MISC && defined _DIRENT_HAVE_D_OFF
-        if ((entry->d_off >= prev_offset) && (rewound)) {
-#else
-        if ((telldir(_dir) >= prev_offset) && (rewound)) {
-#endif
+        if ((entry_offset >= prev_offset) && (rewound)) {
             debug_print("detected an already read offset! Breaking.\n");
             break;
         }
 
-        if (has_excluded_extension(entry->d_name)) {
+        t0 = trace_now();
+        char excluded = has_excluded_extension(entry->d_name);
+        trace_event("filter", t0, NULL);
+        if (excluded) {
             debug_print("Excluded extension in %s.\n", entry->d_name);
             continue;
         }
 
-        g_loadCommand[1] = szFullPath;
-        mpv_command(g_Handle, g_loadCommand);
+        if (g_pairSidecars) {
+            pending_add(&pending, name);
+        } else {
+            append_to_playlist(szFullPath, NULL, NULL);
+        }
         debug_print("added file to playlist: %s.\n", szFullPath);
         (*iAddedFiles)++;
     }
 
-    node->offset = telldir(_dir);
+    if (g_pairSidecars && *iAddedFiles >= iAmount && !rewound && !g_scanServiceLost
+        && can_pair_in(szDirPath)) {
+        take_trailing_sidecars(&_dir, &pending, node);
+    }
+    flush_pending(&pending, szDirPath);
+    node->offset = dir_tell(&_dir);
 
     if (stat(szDirPath, &st) < 0) {
         perror(szDirPath);
     }
     node->mtime = st.st_mtime;
 
-    closedir(_dir);
+    dir_close(&_dir);
     debug_print("Done for %s -> 0.\n", node->name);
+    trace_event("enumerate_dir", t_dir, szDirPath);
     return 0;
 }
 
+/* Build an M3U playlist, in memory, of the next g_maxReadFiles entries of
+ * the directory at path starting at offset: regular files, placeholders for
+ * sub-directories, and a placeholder for the rest of the directory if any.
+ * @param by_entry whether offset is an entry number rather than a telldir()
+ * value, see PLACEHOLDER_PREFIX.
+ * @return a "memory://" URL to free(), or NULL on error.
+ */
+char *expand_placeholder(const char *path, long offset, char by_entry) {
+    uint64_t t_dir = trace_now();
+    dirStream _dir;
+    // A telldir() value is only good for the same kind of stream, the start
+    // of the directory is the same for both.
+    char local = !by_entry && offset != 0;
+    if ((local ? dir_open_local(&_dir, path) : dir_open(&_dir, path)) < 0) {
+        perror(path);
+        return NULL;
+    }
+    if (offset != 0 && (!by_entry || _dir.dir == NULL)) {
+        dir_seek(&_dir, offset);
+    } else if (offset != 0) {
+        // Written through the scan service, which is gone: walk up to the
+        // entry number instead. The service did not count entries other than
+        // files and directories, so this can land a few entries early.
+        debug_print("Walking %s up to entry %ld.\n", path, offset);
+        struct dirent *entry;
+        for (long i = 0; i < offset && (entry = dir_read(&_dir)) != NULL; ) {
+            if (strcmp(entry->d_name, ".") != 0 && strcmp(entry->d_name, "..") != 0)
+                ++i;
+        }
+    }
+
+    char *m3u = NULL;
+    size_t len = 0;
+    FILE *out = open_memstream(&m3u, &len);
+    if (out == NULL) {
+        perror("open_memstream");
+        dir_close(&_dir);
+        return NULL;
+    }
+    fputs("memory://#EXTM3U\n", out);
+
+    uint64_t iAdded = 0;
+    pendingFiles pending = { NULL, 0, 0 };
+    struct dirent *entry;
+    while (iAdded < g_maxReadFiles) {
+        errno = 0;
+        entry = dir_read(&_dir);
+        if (entry == NULL) {
+            if (errno != 0)
+                perror(path);
+            break;
+        }
+        const char *name = entry->d_name;
+        if (strcmp(name, ".") == 0 || strcmp(name, "..") == 0)
+            continue;
+        if (strchr(name, '\n') != NULL) // cannot be written in a playlist
+            continue;
+
+        char szFullPath[PATH_MAX];
+        if (snprintf(szFullPath, sizeof(szFullPath), "%s/%s", path, name)
+            >= sizeof(szFullPath))
+            continue;
+
+        char is_dir, is_reg;
+#if defined __USE_MISC && defined _DIRENT_HAVE_D_TYPE
+        if (entry->d_type != DT_UNKNOWN && entry->d_type != DT_LNK) {
+            is_dir = entry->d_type == DT_DIR;
+            is_reg = entry->d_type == DT_REG;
+        } else
+#endif
+        {
+            struct stat st;
+            if (stat(szFullPath, &st) < 0) {
+                perror(szFullPath);
+                continue;
+            }
+            is_dir = S_ISDIR(st.st_mode);
+            is_reg = S_ISREG(st.st_mode);
+        }
+
+        if (is_dir) {
+            if (g_recurseDirs != 1)
+                continue;
+            fprintf(out, "%s%s#0\n", PLACEHOLDER_PREFIX, szFullPath);
+        } else if (is_reg && !has_excluded_extension(name)) {
+            if (g_pairSidecars)
+                pending_add(&pending, name);
+            else
+                fprintf(out, "%s\n", szFullPath);
+        } else {
+            continue;
+        }
+        iAdded++;
+    }
+    if (g_pairSidecars && g_mpvAutoScan && iAdded == g_maxReadFiles && can_pair_in(path))
+        take_trailing_sidecars(&_dir, &pending, NULL);
+    write_pending(&pending, path, out);
+    // Whatever is left goes into a new placeholder, in place of this one.
+    long resume = dir_tell(&_dir);
+    if (iAdded == g_maxReadFiles && dir_read(&_dir) != NULL) {
+        fprintf(out, "%s%s#%s%ld\n", PLACEHOLDER_PREFIX, path,
+                _dir.dir == NULL ? "e" : "", resume);
+    }
+    fclose(out);
+    dir_close(&_dir);
+    trace_event("expand_placeholder", t_dir, path);
+    return m3u;
+}
+
+/* When playback reaches a placeholder, have mpv open a playlist of its
+ * entries instead. mpv then replaces the placeholder with these entries.
+ */
+void on_load_handler(mpv_event *event) {
+    mpv_event_hook *hook = (mpv_event_hook *)event->data;
+
+    char *url = mpv_get_property_string(g_Handle, "stream-open-filename");
+    if (url != NULL
+        && strncmp(url, PLACEHOLDER_PREFIX, sizeof(PLACEHOLDER_PREFIX) - 1) == 0) {
+        char *path = url + sizeof(PLACEHOLDER_PREFIX) - 1;
+        char *hash = strrchr(path, '#');
+        long offset = 0;
+        char by_entry = 0;
+        if (hash != NULL) {
+            *hash = '\0';
+            by_entry = hash[1] == 'e';
+            offset = strtol(hash + 1 + by_entry, NULL, 10);
+        }
+        debug_print("Expanding %s at offset %ld.\n", path, offset);
+
+        char *m3u = expand_placeholder(path, offset, by_entry);
+        if (m3u != NULL) {
+            check_mpv_err(mpv_set_property_string(g_Handle,
+                                                  "stream-open-filename", m3u));
+            free(m3u);
+        }
+    }
+    mpv_free(url);
+    mpv_hook_continue(g_Handle, hook->id);
+}
+
 void clear_playlist(void) {
     const char *cmd[] = {"playlist-clear", NULL};
     check_mpv_err(mpv_command(g_Handle, cmd));
@@ -411,6 +1478,52 @@ int isValidDirPath(const char * path) {
 
 void update(uint64_t, enum MethodType);
 
+void clear_view(view *v) {
+    v->count = 0;
+    arena_reset(&v->strings);
+}
+
+/* Make room for a freshly scanned view after the newest one, forgetting the
+ * views that were restored with "previous" and the oldest one if needed.
+ * Files added to the playlist are recorded into it until g_History.recording
+ * is reset.
+ */
+void begin_view(void) {
+    while (g_History.back > 0) {
+        clear_view(&g_History.views[g_History.newest]);
+        g_History.newest = (g_History.newest + VIEW_HISTORY_SIZE - 1) % VIEW_HISTORY_SIZE;
+        g_History.count--;
+        g_History.back--;
+    }
+    g_History.newest = (g_History.newest + 1) % VIEW_HISTORY_SIZE;
+    clear_view(&g_History.views[g_History.newest]);
+    if (g_History.count < VIEW_HISTORY_SIZE)
+        g_History.count++;
+    g_History.recording = 1;
+}
+
+/* Replace the playlist with a view kept in memory, without reading storage.
+ * @param back how many views behind the newest one to restore.
+ */
+void restore_view(int back) {
+    int idx = (g_History.newest + VIEW_HISTORY_SIZE - back) % VIEW_HISTORY_SIZE;
+    view *v = &g_History.views[idx];
+    debug_print("Restoring view %d (%lu files).\n", idx, v->count);
+
+    g_History.back = back;
+    clear_playlist();
+    for (uint64_t i = 0; i < v->count; ++i) {
+        append_to_playlist(v->entries[i].path, v->entries[i].sub_files,
+                           v->entries[i].audio_files);
+    }
+
+    char msg[60];
+    snprintf(msg, sizeof(msg), "Restored view %d of %d (%lu files).",
+             g_History.count - back, g_History.count, v->count);
+    const char *cmd[] = {"show-text", msg, "5000" , NULL};
+    check_mpv_err(mpv_command(g_Handle, cmd));
+}
+
 void print_current_pl_entries() {
     uint64_t newcount = get_playlist_length();
     debug_print("Playlist length = %lu.\n", newcount);
@@ -448,19 +1561,22 @@ int on_init() {
 
         if (isValidDirPath(pl_entries[i])) {
             iNumState++;
-            dirNode *_dt = malloc(sizeof(dirNode));
-            if (_dt == NULL) {
-                perror("malloc dirNode");
+            dirNode *_dt = arena_alloc(&g_InitArena, sizeof(dirNode));
+            arena *_nodes = arena_alloc(&g_InitArena, sizeof(arena));
+            char *_name = arena_strdup(&g_InitArena, pl_entries[i]);
+            if (_dt == NULL || _nodes == NULL || _name == NULL) {
                 return -1;
             }
             // Initialize the node.
-            *(_dt) = (dirNode)NODE_INITIALIZER(strdup(pl_entries[i]), 1, NULL);
+            _nodes->head = NULL;
+            *(_dt) = (dirNode)NODE_INITIALIZER(_name, 1, NULL, _nodes,
+                                               arena_mark(_nodes));
             g_InitialPL.entries[i].type = FT_DIR;
             g_InitialPL.entries[i].u.dnode = _dt;
             debug_print("init() new dnode entry %s.\n", g_InitialPL.entries[i].u.dnode->name);
         } else {
             g_InitialPL.entries[i].type = FT_FILE;
-            g_InitialPL.entries[i].u.name = strdup(pl_entries[i]);
+            g_InitialPL.entries[i].u.name = arena_strdup(&g_InitArena, pl_entries[i]);
             debug_print("init() new file entry %s.\n", g_InitialPL.entries[i].u.name);
         }
         mpv_free(pl_entries[i]);
@@ -580,6 +1696,59 @@ char *get_config_path(const char* szScriptName) {
     return strdup(szConfPath);
 }
 
+/* Apply one key=value option, read from either the config file or the
+ * command line. list_delim separates the items of list values.
+ */
+void set_option(const char *key, char *value, const char *list_delim) {
+    char *stop;
+    if (strcmp(key, "enabled") == 0) {
+        g_scriptActive = (unsigned char)strtoul(value, &stop, 10);
+        return;
+    }
+
+    if (strcmp(key, "limit") == 0) {
+        g_maxReadFiles = (uint64_t)strtoul(value, &stop, 10);
+
+        // get the first valid number in value, otherwise default to 0
+        // uint64_t iValue;
+        // if (sscanf(value, "%d", &iValue) != 1){
+        //     iValue = 0;
+        // }
+        // g_maxReadFiles = iValue;
+        debug_print("Set maxReadFile value to %zu.\n", g_maxReadFiles);
+        return;
+    }
+    if (strcmp(key, "recurse") == 0) {
+        g_recurseDirs = (unsigned char)strtoul(value, &stop, 10);
+        debug_print("Set recurseDirs value to %d.\n", g_recurseDirs);
+        return;
+    }
+    if (strcmp(key, "exclude") == 0) {
+        parse_exclude_arg(value, list_delim);
+        return;
+    }
+    if (strcmp(key, "trace") == 0) {
+        trace_open(value);
+        return;
+    }
+    if (strcmp(key, "lazy") == 0) {
+        g_lazyDirs = (unsigned char)strtoul(value, &stop, 10);
+        return;
+    }
+    if (strcmp(key, "sidecars") == 0) {
+        g_pairSidecars = (unsigned char)strtoul(value, &stop, 10);
+        return;
+    }
+    if (strcmp(key, "autoscan") == 0) {
+        g_mpvAutoScan = (unsigned char)strtoul(value, &stop, 10);
+        return;
+    }
+    if (strcmp(key, "daemon") == 0) {
+        g_useScanService = (unsigned char)strtoul(value, &stop, 10);
+        return;
+    }
+}
+
 void get_config(const char* szScriptName) {
     char *szConfPath = get_config_path(szScriptName);
 
@@ -608,34 +1777,7 @@ void get_config(const char* szScriptName) {
         trimwhitespace(key);
         debug_print("Config file valid k:v \"%s\":\"%s\"\n", key, value);
 
-        if (strcmp(key, "enabled") == 0) {
-            char *stop;
-            g_scriptActive = (unsigned char)strtoul(value, &stop, 10);
-            continue;
-        }
-
-        if (strcmp(key, "limit") == 0) {
-            char *stop;
-            g_maxReadFiles = (uint64_t)strtoul(value, &stop, 10);
-
-            // get the first valid number in value, otherwise default to 0
-            // uint64_t iValue;
-            // if (sscanf(value, "%d", &iValue) != 1){
-            //     iValue = 0;
-            // }
-            // g_maxReadFiles = iValue;
-            debug_print("Set maxReadFile value to %zu.\n", g_maxReadFiles);
-            continue;
-        }
-        if (strcmp(key, "recurse") == 0) {
-            char *stop;
-            g_recurseDirs = (unsigned char)strtoul(value, &stop, 10);
-            debug_print("Set recurseDirs value to %d.\n", g_recurseDirs);
-            continue;
-        }
-        if (strcmp(key, "exclude") == 0) {
-            parse_exclude_arg(value, ",");
-        }
+        set_option(key, value, ",");
     }
     free(line);
 #else
@@ -674,33 +1816,10 @@ void get_config(const char* szScriptName) {
                 debug_print("CLI valid k:v \"%s\":\"%s\"\n",
                             key, nl->values[i].u.string);
 
-                if (strcmp(key, "enabled") == 0) {
-                    char *stop;
-                    g_scriptActive = (unsigned char)strtoul(nl->values[i].u.string,
-                                                            &stop, 10);
-                    if (!g_scriptActive) {
-                        return;
-                    }
-                    continue;
-                }
-
-                if (strcmp(key, "limit") == 0) {
-                    char *stop;
-                    g_maxReadFiles = (uint64_t)strtoul(nl->values[i].u.string,
-                                                       &stop, 10);
-                    continue;
-                }
-
-                if (strcmp(key, "recurse") == 0) {
-                    char *stop;
-                    g_recurseDirs = (unsigned char)strtoul(nl->values[i].u.string,
-                                                           &stop, 10);
-                    continue;
-                }
-
-                if (strcmp(key, "exclude") == 0) {
-                    parse_exclude_arg(nl->values[i].u.string, ":");
-                    continue;
+                set_option(key, nl->values[i].u.string, ":");
+                if (strcmp(key, "enabled") == 0 && !g_scriptActive) {
+                    mpv_free_node_contents(&props);
+                    return;
                 }
             }
         }
@@ -719,9 +1838,44 @@ void display_added_files(uint64_t num_files) {
     check_mpv_err(mpv_command(g_Handle, cmd));
 }
 
+/* Start reading a directory of the initial playlist over, from scratch.
+ */
+void reset_root(dirNode *node) {
+    node->offset = 0;
+    node->position = 0;
+    node->mtime = 0;
+    node->rescan = 0;
+    drop_checkpoints(node);
+    forget_seen(node);
+    free_nodes(node);
+}
+
+/* Offsets given by the scan service are entry numbers, which mean nothing
+ * to seekdir(). Once it is gone, none of the cursors can be trusted. Names
+ * are the same for both though: every directory being read is read again
+ * from the start, skipping the entries its fingerprint already holds.
+ */
+void drop_scan_service_cursors(void) {
+    if (!g_scanServiceLost)
+        return;
+    g_scanServiceLost = 0;
+    for (int i = 0; i < g_InitialPL.count; ++i) {
+        if (g_InitialPL.entries[i].type != FT_DIR)
+            continue;
+        for (dirNode *n = g_InitialPL.entries[i].u.dnode; n != NULL; n = n->next) {
+            n->offset = 0;
+            n->position = 0;
+            n->seen_upto = 0;
+            n->rescan = 1;
+            drop_checkpoints(n);
+        }
+    }
+}
+
 void update(uint64_t amount, enum MethodType method) {
     debug_print("===============================================\n\
 update with method %s, amount %lu.\n", METHOD_NAMES[method], amount);
+    uint64_t t_update = trace_now();
 
     // char reset = 0;
     if (method == M_REPLACE) {
@@ -737,12 +1891,22 @@ update with method %s, amount %lu.\n", METHOD_NAMES[method], amount);
     g_lastMethod = method;
     debug_print("RESET %d.\n", reset_memory);
 
+    if (method == M_REPLACE) {
+        begin_view();
+    }
+
+    // Applies to every directory of the initial playlist.
+    char reset = reset_memory >= 1;
+    if (reset) {
+        reset_memory = 0;
+    }
+
     uint64_t iTotalAdded = 0;
 
     for (int i = 0; i < g_InitialPL.count; ++i) {
         if (g_InitialPL.entries[i].type == FT_FILE) {
             if (method == M_REPLACE) {
-                append_to_playlist(g_InitialPL.entries[i].u.name);
+                append_to_playlist(g_InitialPL.entries[i].u.name, NULL, NULL);
             }
             continue;
         }
@@ -751,12 +1915,12 @@ update with method %s, amount %lu.\n", METHOD_NAMES[method], amount);
 
         dirNode *node = g_InitialPL.entries[i].u.dnode;
 
-        if (reset_memory >= 1) {
-            reset_memory = 0;
-            node->offset = 0;
-            node->mtime = 0;
-            free_nodes(node);
+        if (reset) {
+            reset_root(node);
         }
+        // Lost while reading a previous directory, or since the last update.
+        drop_scan_service_cursors();
+retry:
 
         if (node->next == NULL) {
             enumerate_dir( node, amount, &iAddedFiles );
@@ -770,27 +1934,154 @@ update with method %s, amount %lu.\n", METHOD_NAMES[method], amount);
             while (node->prev != NULL) {
                 debug_print("Processing %s as subdir of %s\n", node->name, node->prev->name);
                 int done = enumerate_dir( node, amount, &iAddedFiles );
+                if (g_scanServiceLost)
+                    break;
                 node = node->prev;
                 debug_print("Done processing %s? -> %d.\n", node->next->name, done);
                 if (done == 1) {
                     debug_print("update()->free() %s\n", node->next->name);
-                    free(node->next->name);
-                    free(node->next);
-                    node->next = NULL;
+                    free_nodes(node);
                     continue;
                 } else {
                     break;
                 }
             }
         }
+        if (g_scanServiceLost) {
+            // Carry on in-process from where the fingerprints say we were.
+            drop_scan_service_cursors();
+            node = g_InitialPL.entries[i].u.dnode;
+            goto retry;
+        }
         debug_print("Added files from node %s: %lu.\n", node->name, iAddedFiles);
         iTotalAdded += iAddedFiles;
     }
     debug_print("Added files in total: %lu.\n", iTotalAdded);
+    g_History.recording = 0;
 
     display_added_files(iTotalAdded);
 
     print_current_pl_entries();
+
+    trace_event("update", t_update, NULL);
+    trace_flush();
+}
+
+/* Move the cursor of a root directory to its entry number target, reading
+ * entries only from the nearest checkpoint onwards, without calling stat() and
+ * without adding anything to the playlist. Subdirectory cursors are dropped.
+ * Use UINT64_MAX as target to read up to the end and count the entries.
+ * @return the entry number actually reached.
+ */
+uint64_t seek_dir_entry(dirNode *node, uint64_t target) {
+    uint64_t t_dir = trace_now();
+    drop_scan_service_cursors();
+    dirStream _dir;
+    if (dir_open(&_dir, node->name) < 0) {
+        perror(node->name);
+        return node->position;
+    }
+
+    struct stat st;
+    if (stat(node->name, &st) < 0) {
+        perror(node->name);
+    } else if (node->mtime != st.st_mtime) {
+        debug_print("%s mtime changed! Dropping checkpoints.\n", node->name);
+        drop_checkpoints(node);
+        node->seen_upto = 0; // entry numbers changed
+        node->mtime = st.st_mtime;
+    }
+    free_nodes(node);
+    node->rescan = 0; // the cursor is placed below
+    // The entries walked past are added to the fingerprint, so that they are
+    // not taken for new ones if the directory changes later.
+    sort_seen(node);
+
+    if (node->num_entries >= 0 && target > node->num_entries)
+        target = node->num_entries;
+
+    uint64_t k = target / CHECKPOINT_INTERVAL;
+    if (k > node->num_checkpoints)
+        k = node->num_checkpoints;
+    node->position = k * CHECKPOINT_INTERVAL;
+    if (k > 0) {
+        debug_print("Seeking %s to checkpoint %lu.\n", node->name, k);
+        dir_seek(&_dir, node->checkpoints[k - 1]);
+    }
+
+    struct dirent *entry;
+    while (node->position < target) {
+        errno = 0;
+        entry = dir_read(&_dir);
+        if (entry == NULL) {
+            if (errno != 0) {
+                perror(node->name);
+                break;
+            }
+            node->num_entries = node->position;
+            break;
+        }
+        if (strcmp(entry->d_name, ".") == 0 || strcmp(entry->d_name, "..") == 0)
+            continue;
+
+        node->position++;
+#if defined __USE_MISC && defined _DIRENT_HAVE_D_OFF
+        record_checkpoint(node, entry->d_off);
+#else
+        record_checkpoint(node, dir_tell(&_dir));
+#endif
+        fingerprint_entry(node, hash_name(entry->d_name));
+    }
+    sort_seen(node);
+    node->offset = dir_tell(&_dir);
+    dir_close(&_dir);
+    debug_print("%s now at entry %lu.\n", node->name, node->position);
+    trace_event("seek_dir_entry", t_dir, node->name);
+    return node->position;
+}
+
+/* Replace the playlist with the view starting at entry number index of
+ * every root directory. If fraction is not negative, the entry number is
+ * instead taken at this fraction of each root directory, rounded down to a
+ * multiple of amount.
+ */
+void seek_view(uint64_t index, double fraction, uint64_t amount) {
+    for (int i = 0; i < g_InitialPL.count; ++i) {
+        if (g_InitialPL.entries[i].type == FT_FILE)
+            continue;
+
+        dirNode *node = g_InitialPL.entries[i].u.dnode;
+        uint64_t target = index;
+
+        if (fraction >= 0) {
+            if (node->num_entries < 0) {
+                seek_dir_entry(node, UINT64_MAX);
+            }
+            if (node->num_entries <= 0) {
+                target = 0;
+            } else {
+                if (fraction > 1)
+                    fraction = 1;
+                target = (uint64_t)(fraction * node->num_entries);
+                if (target >= node->num_entries)
+                    target = node->num_entries - 1;
+            }
+            if (amount > 0)
+                target -= target % amount;
+        }
+        seek_dir_entry(node, target);
+        // Past the end: show the last page rather than an empty view.
+        if (node->num_entries > 0 && target >= node->num_entries) {
+            target = node->num_entries - 1;
+            if (amount > 0)
+                target -= target % amount;
+            seek_dir_entry(node, target);
+        }
+    }
+    // The new view is built from the cursors we just placed, make sure
+    // update() does not consider this a method change and reset them.
+    g_lastMethod = M_REPLACE;
+    update(amount, M_REPLACE);
 }
 
 void message_handler(mpv_event *event, const char* szScriptName) {
@@ -802,9 +2093,60 @@ void message_handler(mpv_event *event, const char* szScriptName) {
         if (strcmp(szScriptName, msg->args[0]) != 0) {
             return;
         }
+        uint64_t maxAmount = g_maxReadFiles;
+        if (strcmp(msg->args[1], "page") == 0 ||
+            strcmp(msg->args[1], "jump") == 0) {
+            if (msg->num_args < 3) {
+                fprintf(stderr, "Missing argument to \"%s\".\n", msg->args[1]);
+                return;
+            }
+            char *stop;
+            if (msg->num_args >= 4) {
+                long amount = strtol(msg->args[3], &stop, 10);
+                if (amount < 1) {
+                    fprintf(stderr, "Invalid amount \"%s\".\n", msg->args[3]);
+                    return;
+                }
+                maxAmount = (uint64_t)amount;
+            }
+            if (strcmp(msg->args[1], "jump") == 0) {
+                double fraction = strtod(msg->args[2], &stop);
+                if (fraction < 0)
+                    fraction = 0;
+                seek_view(0, fraction, maxAmount);
+                return;
+            }
+            long page = strtol(msg->args[2], &stop, 10);
+            if (page < 1) {
+                fprintf(stderr, "Invalid page \"%s\".\n", msg->args[2]);
+                return;
+            }
+            // Past the end anyway, seek_view() shows the last page.
+            if (maxAmount > 0 && (uint64_t)(page - 1) > UINT64_MAX / maxAmount)
+                page = UINT64_MAX / maxAmount + 1;
+            seek_view((uint64_t)(page - 1) * maxAmount, -1, maxAmount);
+            return;
+        }
+
+        if (strcmp(msg->args[1], "previous") == 0) {
+            if (g_lastMethod != M_REPLACE
+                || g_History.back + 1 >= g_History.count) {
+                const char *cmd[] = {"show-text", "No previous view.", "5000", NULL};
+                check_mpv_err(mpv_command(g_Handle, cmd));
+                return;
+            }
+            restore_view(g_History.back + 1);
+            return;
+        }
+
         enum MethodType method;
         if (strcmp(msg->args[1], "replace") == 0) {
             method = M_REPLACE;
+            // Go forward through the views restored with "previous" first.
+            if (g_lastMethod == M_REPLACE && g_History.back > 0) {
+                restore_view(g_History.back - 1);
+                return;
+            }
         }
         else if (strcmp(msg->args[1], "append") == 0) {
             method = M_APPEND;
@@ -816,12 +2158,10 @@ method: \"%s\"\n", METHOD_NAMES[g_lastMethod]);
 
         if (msg->num_args >= 3) {
             char *stop;
-            uint64_t maxAmount = (uint64_t)strtol(msg->args[2], &stop, 10);
-            update(maxAmount, method);
-            return;
+            maxAmount = (uint64_t)strtol(msg->args[2], &stop, 10);
         }
-        // 2 arguments, maxAmount not specified.
-        update(g_maxReadFiles, method);
+        // With 2 arguments, maxAmount is not specified.
+        update(maxAmount, method);
     }
 }
 
@@ -833,27 +2173,45 @@ int mpv_open_cplugin(mpv_handle *handle) {
     // debug_print("Limit set to %lu\n", g_maxReadFiles);
 
     if (g_scriptActive <= 0) {
+        trace_close();
         return 0;
     }
 
-    // mpv_hook_add(handle, 0, "on_before_start_file", 50);
+    if (g_lazyDirs) {
+        // Must be in place before playback can reach a placeholder.
+        check_mpv_err(mpv_hook_add(handle, 0, "on_load", 50));
+    }
+
+    if (g_useScanService) {
+        scan_service_connect();
+    }
+
+    if (!g_mpvAutoScan) {
+        // Do not let mpv read directories again looking for external tracks.
+        check_mpv_err(mpv_set_property_string(handle, "sub-auto", "no"));
+        check_mpv_err(mpv_set_property_string(handle, "audio-file-auto", "no"));
+    }
 
     g_scriptActive = on_init();
 
     if (g_scriptActive <= 0) {
+        scan_service_disconnect();
+        trace_close();
         return 0;
     }
 
     while (1) {
         mpv_event *event = mpv_wait_event(handle, -1);
         // debug_print("Got event: %d\n", event->event_id);
-        // if (event->event_id == MPV_EVENT_HOOK)
-        //     on_before_start_file_handler(event);
+        if (event->event_id == MPV_EVENT_HOOK)
+            on_load_handler(event);
         if (event->event_id == MPV_EVENT_CLIENT_MESSAGE)
             message_handler(event, szScriptName);
         if (event->event_id == MPV_EVENT_SHUTDOWN) {
             break;
         }
     }
+    scan_service_disconnect();
+    trace_close();
     return 0;
 }
@@ -0,0 +1,423 @@
+// Build with: make daemon
+// Shared scan service for limited_autoload, see scan_service.h.
+// Run it once per user (eg. "limited_autoloadd &" from a session startup
+// script), then set daemon=1 in limited_autoload.conf. An optional argument
+// overrides the path to the socket.
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <sys/types.h>
+#include <sys/dir.h>
+#include <errno.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <fcntl.h> // fstatat
+#include <signal.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#include "scan_service.h"
+
+#ifndef DEBUG
+#define DEBUG 0
+#endif
+
+#define debug_print(fmt, ...) \
+            do { if (DEBUG) {\
+fprintf(stderr, "%d:%s(): ", __LINE__, __func__); \
+fprintf(stderr, fmt,  ##__VA_ARGS__); } } while (0)
+
+#ifndef PATH_MAX
+#define PATH_MAX 4096
+#endif
+
+// Least recently used directory indexes are dropped beyond that.
+#define MAX_INDEXES 4096
+#define MAX_CLIENTS 64
+// Largest amount of entries sent in one reply.
+#define MAX_REPLY_ENTRIES (SCAN_BATCH * 4)
+
+typedef struct DirIndex dirIndex;
+struct DirIndex {
+    char *path;
+    struct timespec mtime;
+    long next_offset; // where to resume reading the directory
+    char complete; // all entries have been read
+    uint64_t count; // number of entries read so far
+    uint64_t capacity;
+    char *types; // 'd' or 'f' for each entry
+    size_t *names; // offset of the name of each entry in name_buf
+    char *name_buf;
+    size_t name_len;
+    size_t name_capacity;
+    dirIndex *next; // most recently used first
+};
+
+dirIndex *g_Indexes = NULL;
+int g_numIndexes = 0;
+
+typedef struct Client {
+    int fd;
+    size_t len; // bytes of a request received so far
+    char buf[PATH_MAX + 64];
+} client;
+
+client g_Clients[MAX_CLIENTS];
+int g_numClients = 0;
+
+volatile sig_atomic_t g_quit = 0;
+
+void on_signal(int sig) {
+    g_quit = 1;
+}
+
+void clear_index(dirIndex *idx) {
+    idx->next_offset = 0;
+    idx->complete = 0;
+    idx->count = 0;
+    idx->name_len = 0;
+}
+
+void free_index(dirIndex *idx) {
+    free(idx->path);
+    free(idx->types);
+    free(idx->names);
+    free(idx->name_buf);
+    free(idx);
+}
+
+int add_entry(dirIndex *idx, char type, const char *name) {
+    size_t len = strlen(name) + 1;
+    if (idx->count == idx->capacity) {
+        uint64_t capacity = idx->capacity ? idx->capacity * 2 : 64;
+        char *types = realloc(idx->types, capacity);
+        if (types == NULL)
+            return -1;
+        idx->types = types;
+        size_t *names = realloc(idx->names, capacity * sizeof(size_t));
+        if (names == NULL)
+            return -1;
+        idx->names = names;
+        idx->capacity = capacity;
+    }
+    if (idx->name_len + len > idx->name_capacity) {
+        size_t capacity = idx->name_capacity ? idx->name_capacity * 2 : 4096;
+        while (idx->name_len + len > capacity)
+            capacity *= 2;
+        char *name_buf = realloc(idx->name_buf, capacity);
+        if (name_buf == NULL)
+            return -1;
+        idx->name_buf = name_buf;
+        idx->name_capacity = capacity;
+    }
+    memcpy(idx->name_buf + idx->name_len, name, len);
+    idx->types[idx->count] = type;
+    idx->names[idx->count] = idx->name_len;
+    idx->name_len += len;
+    idx->count++;
+    return 0;
+}
+
+/* Read the directory further, until at least upto entries are indexed.
+ * @return 0 on success, or an errno value.
+ */
+int extend_index(dirIndex *idx, uint64_t upto) {
+    if (idx->complete || idx->count >= upto)
+        return 0;
+
+    DIR *_dir = opendir(idx->path);
+    if (_dir == NULL)
+        return errno;
+    if (idx->next_offset != 0)
+        seekdir(_dir, idx->next_offset);
+
+    struct dirent *entry;
+    while (idx->count < upto) {
+        errno = 0;
+        entry = readdir(_dir);
+        if (entry == NULL) {
+            if (errno != 0) {
+                int err = errno;
+                closedir(_dir);
+                return err;
+            }
+            idx->complete = 1;
+            break;
+        }
+        if (strcmp(entry->d_name, ".") == 0 || strcmp(entry->d_name, "..") == 0)
+            continue;
+
+        char type = 0;
+#if defined _DIRENT_HAVE_D_TYPE
+        if (entry->d_type == DT_DIR)
+            type = 'd';
+        else if (entry->d_type == DT_REG)
+            type = 'f';
+        else if (entry->d_type == DT_UNKNOWN || entry->d_type == DT_LNK)
+#endif
+        {
+            struct stat st;
+            if (fstatat(dirfd(_dir), entry->d_name, &st, 0) == 0) {
+                if (S_ISDIR(st.st_mode))
+                    type = 'd';
+                else if (S_ISREG(st.st_mode))
+                    type = 'f';
+            }
+        }
+        if (type == 0)
+            continue;
+
+        if (add_entry(idx, type, entry->d_name) < 0) {
+            closedir(_dir);
+            return ENOMEM;
+        }
+    }
+    idx->next_offset = telldir(_dir);
+    closedir(_dir);
+    debug_print("%s: %lu entries indexed.\n", idx->path, idx->count);
+    return 0;
+}
+
+/* @return the up to date index of the directory at path, or NULL with errno
+ * set.
+ */
+dirIndex *get_index(const char *path) {
+    struct stat st;
+    if (stat(path, &st) < 0)
+        return NULL;
+    if (!S_ISDIR(st.st_mode)) {
+        errno = ENOTDIR;
+        return NULL;
+    }
+
+    dirIndex *prev = NULL;
+    dirIndex *idx = g_Indexes;
+    while (idx != NULL && strcmp(idx->path, path) != 0) {
+        prev = idx;
+        idx = idx->next;
+    }
+
+    if (idx != NULL) {
+        if (prev != NULL) { // move to front
+            prev->next = idx->next;
+            idx->next = g_Indexes;
+            g_Indexes = idx;
+        }
+        if (idx->mtime.tv_sec != st.st_mtim.tv_sec
+            || idx->mtime.tv_nsec != st.st_mtim.tv_nsec) {
+            debug_print("%s changed, indexing again.\n", path);
+            clear_index(idx);
+            idx->mtime = st.st_mtim;
+        }
+        return idx;
+    }
+
+    idx = calloc(1, sizeof(dirIndex));
+    if (idx == NULL)
+        return NULL;
+    idx->path = strdup(path);
+    if (idx->path == NULL) {
+        free(idx);
+        return NULL;
+    }
+    idx->mtime = st.st_mtim;
+    idx->next = g_Indexes;
+    g_Indexes = idx;
+
+    if (++g_numIndexes > MAX_INDEXES) {
+        dirIndex *last = g_Indexes;
+        while (last->next->next != NULL)
+            last = last->next;
+        debug_print("Dropping index of %s.\n", last->next->path);
+        free_index(last->next);
+        last->next = NULL;
+        g_numIndexes--;
+    }
+    return idx;
+}
+
+int send_all(int fd, const char *buf, size_t len) {
+    while (len > 0) {
+        ssize_t n = send(fd, buf, len, MSG_NOSIGNAL);
+        if (n < 0) {
+            if (errno == EINTR)
+                continue;
+            return -1;
+        }
+        buf += n;
+        len -= n;
+    }
+    return 0;
+}
+
+/* @return -1 if the client should be disconnected.
+ */
+int handle_request(int fd, char *line) {
+    unsigned long start, count;
+    int pos = 0;
+    if (sscanf(line, "READ %lu %lu %n", &start, &count, &pos) != 2 || pos == 0) {
+        fprintf(stderr, "Invalid request: \"%s\".\n", line);
+        return -1;
+    }
+    const char *path = line + pos;
+    if (count > MAX_REPLY_ENTRIES)
+        count = MAX_REPLY_ENTRIES;
+
+    char *reply = NULL;
+    size_t reply_len = 0;
+    FILE *out = open_memstream(&reply, &reply_len);
+    if (out == NULL)
+        return -1;
+
+    int err = 0;
+    dirIndex *idx = get_index(path);
+    if (idx == NULL)
+        err = errno;
+    else
+        err = extend_index(idx, start + count);
+
+    if (err != 0) {
+        fprintf(out, "ERR %d\n", err);
+    } else {
+        uint64_t end = start + count;
+        if (end > idx->count)
+            end = idx->count;
+        if (start > end)
+            start = end;
+        int eof = idx->complete && end == idx->count;
+        fprintf(out, "OK %lu %d\n", (unsigned long)(end - start), eof);
+        for (uint64_t i = start; i < end; ++i) {
+            const char *name = idx->name_buf + idx->names[i];
+            fprintf(out, "%c %zu %s\n", idx->types[i], strlen(name), name);
+        }
+    }
+    fclose(out);
+
+    int ret = send_all(fd, reply, reply_len);
+    free(reply);
+    return ret;
+}
+
+void drop_client(int i) {
+    debug_print("Client %d disconnected.\n", g_Clients[i].fd);
+    close(g_Clients[i].fd);
+    g_Clients[i] = g_Clients[--g_numClients];
+}
+
+/* Process every complete line received from client i.
+ * @return -1 if the client is gone.
+ */
+int read_client(int i) {
+    client *c = &g_Clients[i];
+    ssize_t n = recv(c->fd, c->buf + c->len, sizeof(c->buf) - 1 - c->len, 0);
+    if (n <= 0)
+        return -1;
+    c->len += n;
+    c->buf[c->len] = '\0';
+
+    char *line = c->buf;
+    char *eol;
+    while ((eol = strchr(line, '\n')) != NULL) {
+        *eol = '\0';
+        if (handle_request(c->fd, line) < 0)
+            return -1;
+        line = eol + 1;
+    }
+    c->len -= line - c->buf;
+    if (c->len == sizeof(c->buf) - 1) // line too long
+        return -1;
+    memmove(c->buf, line, c->len);
+    return 0;
+}
+
+int main(int argc, char **argv) {
+    struct sockaddr_un addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    if (argc > 1)
+        snprintf(addr.sun_path, sizeof(addr.sun_path), "%s", argv[1]);
+    else
+        scan_service_socket_path(addr.sun_path, sizeof(addr.sun_path));
+
+    int lfd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (lfd < 0) {
+        perror("socket");
+        return 1;
+    }
+    if (connect(lfd, (struct sockaddr *)&addr, sizeof(addr)) == 0) {
+        fprintf(stderr, "Already running on %s.\n", addr.sun_path);
+        return 1;
+    }
+    unlink(addr.sun_path); // stale socket
+
+    umask(077);
+    if (bind(lfd, (struct sockaddr *)&addr, sizeof(addr)) < 0
+        || listen(lfd, MAX_CLIENTS) < 0) {
+        perror(addr.sun_path);
+        return 1;
+    }
+    debug_print("Listening on %s.\n", addr.sun_path);
+
+    struct sigaction sa;
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = on_signal;
+    sigaction(SIGINT, &sa, NULL);
+    sigaction(SIGTERM, &sa, NULL);
+    signal(SIGPIPE, SIG_IGN);
+
+    struct pollfd fds[MAX_CLIENTS + 1];
+    while (!g_quit) {
+        fds[0].fd = lfd;
+        fds[0].events = POLLIN;
+        for (int i = 0; i < g_numClients; ++i) {
+            fds[i + 1].fd = g_Clients[i].fd;
+            fds[i + 1].events = POLLIN;
+        }
+        int nfds = g_numClients + 1;
+        if (poll(fds, nfds, -1) < 0) {
+            if (errno == EINTR)
+                continue;
+            perror("poll");
+            break;
+        }
+
+        // Clients first, as accepting one changes g_Clients.
+        for (int i = nfds - 2; i >= 0; --i) {
+            if (fds[i + 1].revents == 0)
+                continue;
+            if (read_client(i) < 0)
+                drop_client(i);
+        }
+
+        if (fds[0].revents & POLLIN) {
+            int fd = accept(lfd, NULL, NULL);
+            if (fd < 0) {
+                perror("accept");
+                continue;
+            }
+            if (g_numClients == MAX_CLIENTS) {
+                fprintf(stderr, "Too many clients.\n");
+                close(fd);
+                continue;
+            }
+            debug_print("Client %d connected.\n", fd);
+            g_Clients[g_numClients].fd = fd;
+            g_Clients[g_numClients].len = 0;
+            g_numClients++;
+        }
+    }
+
+    close(lfd);
+    unlink(addr.sun_path);
+    while (g_numClients > 0)
+        drop_client(g_numClients - 1);
+    while (g_Indexes != NULL) {
+        dirIndex *next = g_Indexes->next;
+        free_index(g_Indexes);
+        g_Indexes = next;
+    }
+    return 0;
+}
@@ -0,0 +1,43 @@
+/* Protocol between limited_autoload and the limited_autoloadd scan service.
+ *
+ * The service keeps an in-memory index of every directory it was asked
+ * about, so that several mpv instances browsing the same roots share a
+ * single warm index instead of each reading the directories on their own.
+ * Clients talk to it over a Unix domain socket, one request per line:
+ *
+ *     READ <index> <count> <absolute path>\n
+ *
+ * asks for at most count entries of the directory, starting at entry number
+ * index. "." and ".." are never listed, neither are entries that are not
+ * regular files or directories (symbolic links are resolved). The reply is
+ *
+ *     OK <n> <eof>\n
+ *
+ * followed by n entries, each formatted as
+ *
+ *     <type> <length> <name>\n
+ *
+ * where type is 'd' for a directory and 'f' for a regular file, and length
+ * is the length in bytes of name. eof is 1 if no entry follows the last one
+ * of this reply. On failure, the reply is
+ *
+ *     ERR <errno>\n
+ */
+#ifndef SCAN_SERVICE_H
+#define SCAN_SERVICE_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+// Number of entries requested at once by clients.
+#define SCAN_BATCH 256
+
+static int scan_service_socket_path(char *buf, size_t size) {
+    const char *dir = getenv("XDG_RUNTIME_DIR");
+    if (dir != NULL && dir[0] != '\0')
+        return snprintf(buf, size, "%s/limited_autoload.sock", dir);
+    return snprintf(buf, size, "/tmp/limited_autoload-%u.sock", (unsigned)getuid());
+}
+
+#endif